@@ -208,8 +208,12 @@ FSBindingStart(EFI_DRIVER_BINDING_PROTOCOL *This,
 	}
 
 	Status = FSInstall(Instance, ControllerHandle);
-	if (EFI_ERROR(Status))
+	if (EFI_ERROR(Status)) {
 		GrubDeviceExit(Instance);
+		/* This may still be a member of a multi device file system */
+		if (Status == EFI_UNSUPPORTED)
+			GrubAddCandidate(Instance);
+	}
 
 error:
 	if (EFI_ERROR(Status)) {
@@ -383,6 +387,8 @@ FSDriverUninstall(EFI_HANDLE ImageHandle)
 	/* Release the relevant GRUB module(s) */
 	for (i = 0; GrubModuleExit[i] != NULL; i++)
 		GrubModuleExit[i]();
+	GrubFreeCandidates();
+	GrubDriverExit();
 
 	/* Uninstall our mutex (we're the only instance that can run this code) */
 	BS->UninstallMultipleProtocolInterfaces(MutexHandle,
@@ -447,6 +453,12 @@ FSDriverInstall(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
 		return Status;
 	}
 
+	Status = GrubDriverInit();
+	if (EFI_ERROR(Status)) {
+		PrintStatusError(Status, L"Could not initialize driver");
+		return Status;
+	}
+
 	/* Configure driver binding protocol */
 	FSDriverBinding.ImageHandle = ImageHandle;
 	FSDriverBinding.DriverBindingHandle = ImageHandle;
@@ -459,6 +471,7 @@ FSDriverInstall(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
 			NULL);
 	if (EFI_ERROR(Status)) {
 		PrintStatusError(Status, L"Could not bind driver");
+		GrubDriverExit();
 		return Status;
 	}
 
@@ -470,6 +483,7 @@ FSDriverInstall(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
 		GrubModuleInit[i]();
 
 	InitializeListHead(&FsListHead);
+	InitializeListHead(&FsCandidateListHead);
 
 	PrintDebug(L"FS driver installed.\n");
 	return EFI_SUCCESS;
@@ -83,9 +83,11 @@
 #if defined(_GNU_EFI)
 #define STUPID_CLANG_REF(a,b) a.b
 #define FORWARD_LINK_REF(list) STUPID_CLANG_REF(list,Flink)
+#define BACKWARD_LINK_REF(list) STUPID_CLANG_REF(list,Blink)
 #else
 #define STUPID_CLANG_REF(a,b) a.b
 #define FORWARD_LINK_REF(list) STUPID_CLANG_REF(list, ForwardLink)
+#define BACKWARD_LINK_REF(list) STUPID_CLANG_REF(list, BackLink)
 #define Atoi (INTN)StrDecimalToUintn
 #define APrint AsciiPrint
 #define strlena AsciiStrLen
@@ -113,6 +115,10 @@
 #define MIN(x,y)                ((x)<(y)?(x):(y))
 #endif
 
+#ifndef MAX
+#define MAX(x,y)                ((x)>(y)?(x):(y))
+#endif
+
 #define _STRINGIFY(s)           #s
 #define STRINGIFY(s)            _STRINGIFY(s)
 
@@ -123,6 +129,20 @@
 #define MINIMUM_INFO_LENGTH     (SIZE_OF_EFI_FILE_INFO + MAX_FILE_NAME_LEN * sizeof(CHAR16))
 #define MINIMUM_FS_INFO_LENGTH  (SIZE_OF_EFI_FILE_SYSTEM_INFO + MAX_FILE_NAME_LEN * sizeof(CHAR16))
 #define IS_ROOT(File)           (File == File->FileSystem->RootFile)
+#define MAX_FILE_EXTENTS        16384
+#define READ_WINDOW_SIZE        (64 * 1024)
+#define MAX_READ_AHEAD_SIZE     (1024 * 1024)
+#define WINDOW_POOL_SIZE        (8 * 1024 * 1024)
+#define WINDOW_POOL_FILE_SHARE  2
+#define WINDOW_POOL_BUCKETS     64
+#define DISK_CACHE_UNIT_SIZE    4096
+#define DISK_CACHE_NUM_UNITS    256
+#define DISK_CACHE_WAYS         4
+#define PATH_CACHE_BUCKETS      256
+#define PATH_CACHE_MAX_ENTRIES  4096
+#define PATH_CACHE_MAX_MISSES   512
+#define EXTENT_MAP_POOL_SHARE   4
+#define EXTENT_MAP_BUCKETS      64
 
 /* Logging */
 #define FS_LOGLEVEL_NONE        0
@@ -156,6 +176,48 @@ extern Print_t PrintExtra;
 /* Forward declaration */
 struct _EFI_FS;
 
+/* A run of file data that is stored contiguously on disk */
+typedef struct _EFI_GRUB_EXTENT {
+	UINT64                 Offset;
+	UINT64                 Length;
+	UINT64                 Address;
+} EFI_GRUB_EXTENT;
+
+/* The extents of a closed file, kept for when it gets reopened */
+typedef struct _EFI_EXTENT_MAP {
+	LIST_ENTRY            *Flink;
+	LIST_ENTRY            *Blink;
+	LIST_ENTRY             Bucket;
+	UINT32                 Hash;
+	UINTN                  AllocSize;
+	EFI_GRUB_EXTENT       *Extents;
+	UINTN                  NumExtents;
+	UINTN                  MaxExtents;
+	UINT64                 FileSize;
+	CHAR8                  Path[1];
+} EFI_EXTENT_MAP;
+
+/* A read window, holding file data that GRUB had to decode for us */
+typedef struct _EFI_READ_WINDOW {
+	LIST_ENTRY            *Flink;
+	LIST_ENTRY            *Blink;
+	LIST_ENTRY             Bucket;
+	UINT32                 Hash;
+	UINT64                 Offset;
+	UINTN                  Size;
+	UINTN                  AllocSize;
+	CHAR8                 *Data;
+	CHAR8                  Path[1];
+} EFI_READ_WINDOW;
+
+/* A directory entry, as listed by GRUB */
+typedef struct _EFI_DIR_ENTRY {
+	CHAR8                 *Name;
+	BOOLEAN                IsDir;
+	BOOLEAN                MtimeSet;
+	INT32                  Mtime;
+} EFI_DIR_ENTRY;
+
 /* A file instance */
 typedef struct _EFI_GRUB_FILE {
 	EFI_FILE               EfiFile;
@@ -167,8 +229,38 @@ typedef struct _EFI_GRUB_FILE {
 	INTN                   RefCount;
 	VOID                  *GrubFile;
 	struct _EFI_FS        *FileSystem;
+	EFI_GRUB_EXTENT       *Extents;
+	UINTN                  NumExtents;
+	UINTN                  MaxExtents;
+	EFI_READ_WINDOW       *Window;
+	UINTN                  ReadAhead;
+	EFI_DIR_ENTRY         *DirEntries;
+	UINTN                  NumDirEntries;
+	UINTN                  MaxDirEntries;
+	UINT32                 MediaId;
 } EFI_GRUB_FILE;
 
+/* A disk cache entry */
+typedef struct _EFI_DISK_CACHE_ENTRY {
+	UINT64                 Unit;
+	UINTN                  LastUsed;
+} EFI_DISK_CACHE_ENTRY;
+
+/* A path lookup cache entry */
+typedef struct _EFI_PATH_CACHE_ENTRY {
+	LIST_ENTRY            *Flink;
+	LIST_ENTRY            *Blink;
+	struct _EFI_PATH_CACHE_ENTRY *Next;
+	UINT32                 Hash;
+	BOOLEAN                Exists;
+	BOOLEAN                IsDir;
+	BOOLEAN                Complete;
+	BOOLEAN                SizeSet;
+	INT32                  Mtime;
+	UINT64                 Size;
+	CHAR8                  Path[1];
+} EFI_PATH_CACHE_ENTRY;
+
 /* A file system instance */
 typedef struct _EFI_FS {
 	LIST_ENTRY                      *Flink;
@@ -183,8 +275,33 @@ typedef struct _EFI_FS {
 	EFI_DISK_IO2_TOKEN              DiskIo2Token;
 	EFI_GRUB_FILE                   *RootFile;
 	VOID                            *GrubDevice;
+	BOOLEAN                         IsCandidate;
+	UINT32                          MediaId;
+	EFI_DISK_CACHE_ENTRY            *DiskCache;
+	CHAR8                           *DiskCacheData;
+	UINTN                           DiskCacheTick;
+	EFI_PATH_CACHE_ENTRY            **PathCache;
+	UINTN                           PathCacheSize;
+	UINTN                           PathCacheMisses;
+	UINTN                           PathCacheEvictions;
+	LIST_ENTRY                      PathCacheLru;
+	LIST_ENTRY                      PathCacheMissLru;
+	LIST_ENTRY                      WindowPool;
+	LIST_ENTRY                      WindowBuckets[WINDOW_POOL_BUCKETS];
+	UINTN                           WindowPoolSize;
+	UINTN                           WindowPoolMax;
+	LIST_ENTRY                      ExtentMaps;
+	LIST_ENTRY                      ExtentMapBuckets[EXTENT_MAP_BUCKETS];
+	UINTN                           ExtentMapsSize;
 } EFI_FS;
 
+/* A volume that didn't probe, but that may be part of a multi device file system */
+typedef struct _EFI_FS_CANDIDATE {
+	LIST_ENTRY            *Flink;
+	LIST_ENTRY            *Blink;
+	EFI_DEVICE_PATH       *DevicePath;
+} EFI_FS_CANDIDATE;
+
 /* Mirrors a similar construct from GRUB, while EFI-zing it */
 typedef struct _GRUB_DIRHOOK_INFO {
 	UINT32                 Dir:1;
@@ -204,6 +321,7 @@ extern UINTN LogLevel;
 extern EFI_HANDLE EfiImageHandle;
 extern EFI_GUID ShellVariable;
 extern LIST_ENTRY FsListHead;
+extern LIST_ENTRY FsCandidateListHead;
 extern CHAR16 *ShortDriverName, *FullDriverName;
 extern GRUB_MOD_INIT GrubModuleInit[];
 extern GRUB_MOD_EXIT GrubModuleExit[];
@@ -211,18 +329,23 @@ extern GRUB_MOD_EXIT GrubModuleExit[];
 #define strcpya(dst, src) CopyMem((VOID*)dst, (VOID*)src, strlena(src) + 1)
 extern VOID SetLogging(VOID);
 extern VOID PrintStatus(EFI_STATUS Status);
-extern VOID GrubDriverInit(VOID);
+extern EFI_STATUS GrubDriverInit(VOID);
 extern VOID GrubDriverExit(VOID);
 extern CHAR16 *GrubGetUuid(EFI_FS *This);
 extern BOOLEAN GrubFSProbe(EFI_FS *This);
 extern EFI_STATUS GrubDeviceInit(EFI_FS *This);
 extern EFI_STATUS GrubDeviceExit(EFI_FS *This);
+extern VOID GrubCheckMedia(EFI_FS *This);
+extern VOID GrubAddCandidate(EFI_FS *This);
+extern VOID GrubFreeCandidates(VOID);
 extern VOID GrubTimeToEfiTime(const INT32 t, EFI_TIME *tp);
 extern VOID CopyPathRelative(CHAR8 *dest, CHAR8 *src, INTN len);
+extern UINT32 PathHash(const CHAR8 *Path);
 extern EFI_STATUS GrubOpen(EFI_GRUB_FILE *File);
 extern EFI_STATUS GrubDir(EFI_GRUB_FILE *File, const CHAR8 *path,
 		GRUB_DIRHOOK Hook, VOID *HookData);
 extern VOID GrubClose(EFI_GRUB_FILE *File);
+extern BOOLEAN GrubIsFileNotFound(VOID);
 extern EFI_STATUS GrubRead(EFI_GRUB_FILE *File, VOID *Data, UINTN *Len);
 extern EFI_STATUS GrubLabel(EFI_GRUB_FILE *File, CHAR8 **label);
 extern EFI_STATUS GrubCreateFile(EFI_GRUB_FILE **File, EFI_FS *This);
@@ -238,6 +361,7 @@ extern EFI_STATUS Utf16ToUtf8NoAlloc(CHAR16 *Src, CHAR8 *dst, UINTN len);
 extern EFI_STATUS Utf16ToUtf8NoAllocUpdateLen(CHAR16 *Src, CHAR8 *dst, UINTN *len);
 extern EFI_STATUS FSInstall(EFI_FS *This, EFI_HANDLE ControllerHandle);
 extern VOID FSUninstall(EFI_FS *This, EFI_HANDLE ControllerHandle);
+extern VOID PathCacheFree(EFI_FS *This);
 extern EFI_STATUS EFIAPI FileOpenVolume(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *This,
 		EFI_FILE_HANDLE *Root);
 extern EFI_GUID *GetFSGuid(VOID);
@@ -46,21 +46,217 @@ FileName(EFI_GRUB_FILE *File)
 	return Path;
 }
 
+/*
+ * Since GRUB has to go through the parent directory to tell us whether a
+ * path is a directory, and what its timestamp is, we keep a per volume
+ * hash of the paths we already resolved, so that reopening the same file
+ * or directory doesn't require a new lookup.
+ * Paths that don't exist are also recorded, as they are the costliest to
+ * look up (the whole parent directory must be walked) and applications
+ * tend to probe for the same missing files over and over. Only actual
+ * GRUB_ERR_FILE_NOT_FOUND errors count, as a volume that GRUB could not
+ * mount this time round (e.g. a multi device one) may do so later.
+ * Entries are kept in LRU order, with misses getting a budget of their own,
+ * so that probing for missing files can't push out the paths that exist.
+ */
+static EFI_PATH_CACHE_ENTRY *
+PathCacheFind(EFI_FS *FileSystem, const CHAR8 *Path)
+{
+	EFI_PATH_CACHE_ENTRY *Entry;
+	UINT32 Hash;
+
+	if (FileSystem->PathCache == NULL)
+		return NULL;
+
+	Hash = PathHash(Path);
+	for (Entry = FileSystem->PathCache[Hash % PATH_CACHE_BUCKETS]; Entry != NULL; Entry = Entry->Next) {
+		if ((Entry->Hash == Hash) && (strcmpa(Entry->Path, Path) == 0))
+			return Entry;
+	}
+	return NULL;
+}
+
+static EFI_PATH_CACHE_ENTRY *
+PathCacheLookup(EFI_FS *FileSystem, const CHAR8 *Path)
+{
+	EFI_PATH_CACHE_ENTRY *Entry = PathCacheFind(FileSystem, Path);
+
+	if (Entry != NULL) {
+		RemoveEntryList((LIST_ENTRY *) Entry);
+		InsertHeadList((Entry->Exists) ? &FileSystem->PathCacheLru :
+			&FileSystem->PathCacheMissLru, (LIST_ENTRY *) Entry);
+	}
+	return Entry;
+}
+
+/* Drop the least recently used entry from an LRU list */
+static VOID
+PathCacheEvict(EFI_FS *FileSystem, LIST_ENTRY *Lru)
+{
+	EFI_PATH_CACHE_ENTRY *Entry, *Parent, **Link;
+	CHAR8 ParentPath[MAX_FILE_NAME_LEN];
+	INTN i;
+
+	Entry = (EFI_PATH_CACHE_ENTRY *) BACKWARD_LINK_REF(Lru[0]);
+	RemoveEntryList((LIST_ENTRY *) Entry);
+	for (Link = &FileSystem->PathCache[Entry->Hash % PATH_CACHE_BUCKETS];
+			*Link != Entry; Link = &(*Link)->Next);
+	*Link = Entry->Next;
+	FileSystem->PathCacheSize--;
+	if (!Entry->Exists)
+		FileSystem->PathCacheMisses--;
+	FileSystem->PathCacheEvictions++;
+
+	/* Without this entry, the listing we have for its parent is incomplete */
+	if (Entry->Exists && (Entry->Path[1] != 0)) {
+		for (i = strlena(Entry->Path) - 1; (i > 0) && (Entry->Path[i] != '/'); i--);
+		CopyMem(ParentPath, Entry->Path, i);
+		ParentPath[i] = 0;
+		Parent = PathCacheFind(FileSystem, (i > 0) ? ParentPath : "/");
+		if (Parent != NULL)
+			Parent->Complete = FALSE;
+	}
+	FreePool(Entry);
+}
+
+/* Returns TRUE if the path is in the cache once we're done */
+static BOOLEAN
+PathCacheAdd(EFI_FS *FileSystem, const CHAR8 *Path, BOOLEAN Exists, BOOLEAN IsDir, INT32 Mtime)
+{
+	EFI_PATH_CACHE_ENTRY *Entry;
+	UINTN Len = strlena(Path);
+
+	if (PathCacheLookup(FileSystem, Path) != NULL)
+		return TRUE;
+
+	if (FileSystem->PathCache == NULL) {
+		FileSystem->PathCache = AllocateZeroPool(PATH_CACHE_BUCKETS * sizeof(EFI_PATH_CACHE_ENTRY *));
+		if (FileSystem->PathCache == NULL)
+			return FALSE;
+		InitializeListHead(&FileSystem->PathCacheLru);
+		InitializeListHead(&FileSystem->PathCacheMissLru);
+	}
+
+	if (Exists && (FileSystem->PathCacheSize - FileSystem->PathCacheMisses >= PATH_CACHE_MAX_ENTRIES))
+		PathCacheEvict(FileSystem, &FileSystem->PathCacheLru);
+	if (!Exists && (FileSystem->PathCacheMisses >= PATH_CACHE_MAX_MISSES))
+		PathCacheEvict(FileSystem, &FileSystem->PathCacheMissLru);
+
+	Entry = AllocatePool(sizeof(EFI_PATH_CACHE_ENTRY) + Len);
+	if (Entry == NULL)
+		return FALSE;
+	Entry->Hash = PathHash(Path);
+	Entry->Exists = Exists;
+	Entry->IsDir = IsDir;
+	Entry->Complete = FALSE;
+	Entry->SizeSet = FALSE;
+	Entry->Mtime = Mtime;
+	Entry->Size = 0;
+	CopyMem(Entry->Path, (VOID *) Path, Len + 1);
+	Entry->Next = FileSystem->PathCache[Entry->Hash % PATH_CACHE_BUCKETS];
+	FileSystem->PathCache[Entry->Hash % PATH_CACHE_BUCKETS] = Entry;
+	InsertHeadList((Exists) ? &FileSystem->PathCacheLru : &FileSystem->PathCacheMissLru,
+		(LIST_ENTRY *) Entry);
+	FileSystem->PathCacheSize++;
+	if (!Exists)
+		FileSystem->PathCacheMisses++;
+	return TRUE;
+}
+
+/* Record the size of a file, so that listing its directory doesn't need to open it */
+static VOID
+PathCacheSetSize(EFI_FS *FileSystem, const CHAR8 *Path, UINT64 Size)
+{
+	EFI_PATH_CACHE_ENTRY *Entry = PathCacheFind(FileSystem, Path);
+
+	if ((Entry != NULL) && Entry->Exists) {
+		Entry->Size = Size;
+		Entry->SizeSet = TRUE;
+	}
+}
+
+VOID
+PathCacheFree(EFI_FS *FileSystem)
+{
+	EFI_PATH_CACHE_ENTRY *Entry, *Next;
+	UINTN i;
+
+	if (FileSystem->PathCache == NULL)
+		return;
+
+	for (i = 0; i < PATH_CACHE_BUCKETS; i++) {
+		for (Entry = FileSystem->PathCache[i]; Entry != NULL; Entry = Next) {
+			Next = Entry->Next;
+			FreePool(Entry);
+		}
+	}
+	FreePool(FileSystem->PathCache);
+	FileSystem->PathCache = NULL;
+	FileSystem->PathCacheSize = 0;
+	FileSystem->PathCacheMisses = 0;
+}
+
+/* ASCII case insensitive version of strcmpa */
+static INTN
+StrCmpNoCase(const CHAR8 *s1, const CHAR8 *s2)
+{
+	CHAR8 c1, c2;
+
+	do {
+		c1 = *s1++;
+		c2 = *s2++;
+		if ((c1 >= 'A') && (c1 <= 'Z'))
+			c1 += 'a' - 'A';
+		if ((c2 >= 'A') && (c2 <= 'Z'))
+			c2 += 'a' - 'A';
+	} while ((c1 != 0) && (c1 == c2));
+
+	return (INTN) c1 - (INTN) c2;
+}
+
+typedef struct {
+	EFI_GRUB_FILE *File;
+	BOOLEAN       Found;
+	BOOLEAN       Cached;
+} INFO_HOOK_DATA;
+
 /* Simple hook to populate the timestamp and directory flag when opening a file */
 static INT32
 InfoHook(const CHAR8 *name, const GRUB_DIRHOOK_INFO *Info, VOID *Data)
 {
-	EFI_GRUB_FILE *File = (EFI_GRUB_FILE *) Data;
+	INFO_HOOK_DATA *HookData = (INFO_HOOK_DATA *) Data;
+	EFI_GRUB_FILE *File = HookData->File;
+	char path[MAX_FILE_NAME_LEN];
+	UINTN len;
 
 	/* Look for a specific file */
-	if (strcmpa(name, File->basename) != 0)
+	if ((Info->CaseInsensitive) ? (StrCmpNoCase(name, File->basename) != 0) :
+		(strcmpa(name, File->basename) != 0)) {
+		/* Since GRUB went to the trouble of reading it, record this entry too */
+		len = (UINTN)(File->basename - File->path);
+		if ((strcmpa(name, ".") == 0) || (strcmpa(name, "..") == 0))
+			return 0;
+		if (len + strlena(name) >= sizeof(path)) {
+			HookData->Cached = FALSE;
+			return 0;
+		}
+		CopyMem(path, File->path, len);
+		strcpya(&path[len], name);
+		/* A case insensitive listing can't be used to rule names out */
+		if (!PathCacheAdd(File->FileSystem, path, TRUE, (BOOLEAN) (Info->Dir),
+				(Info->MtimeSet) ? Info->Mtime : 0) || (Info->CaseInsensitive))
+			HookData->Cached = FALSE;
 		return 0;
+	}
 
+	HookData->Found = TRUE;
 	File->IsDir = (BOOLEAN) (Info->Dir);
 	if (Info->MtimeSet)
 		File->Mtime = Info->Mtime;
+	PathCacheAdd(File->FileSystem, File->path, TRUE, File->IsDir, File->Mtime);
 
-	return 0;
+	/* No need to go through the rest of the directory */
+	return 1;
 }
 
 /**
@@ -80,6 +276,9 @@ FileOpen(EFI_FILE_HANDLE This, EFI_FILE_HANDLE *New,
 	EFI_STATUS Status;
 	EFI_GRUB_FILE *File = _CR(This, EFI_GRUB_FILE, EfiFile);
 	EFI_GRUB_FILE *NewFile;
+	EFI_PATH_CACHE_ENTRY *Entry, *DirEntry;
+	INFO_HOOK_DATA HookData;
+	UINTN Evictions;
 
 	// TODO: Use dynamic buffers?
 	char path[MAX_FILE_NAME_LEN], clean_path[MAX_FILE_NAME_LEN], *dirname;
@@ -147,6 +346,9 @@ FileOpen(EFI_FILE_HANDLE This, EFI_FILE_HANDLE *New,
 		return EFI_SUCCESS;
 	}
 
+	/* Don't look up paths we cached for another media */
+	GrubCheckMedia(File->FileSystem);
+
 	// TODO: eventually we should seek for already opened files and increase RefCount
 	/* Allocate and initialise an instance of a file */
 	Status = GrubCreateFile(&NewFile, File->FileSystem);
@@ -174,25 +376,65 @@ FileOpen(EFI_FILE_HANDLE This, EFI_FILE_HANDLE *New,
 	NewFile->basename = &NewFile->path[i+1];
 
 	/* Find if we're working with a directory and fill the grub timestamp */
-	Status = GrubDir(NewFile, dirname, InfoHook, (VOID *) NewFile);
-	if (EFI_ERROR(Status)) {
-		if (Status != EFI_NOT_FOUND)
-			PrintStatusError(Status, L"Could not get file attributes for '%s'", Name);
+	Entry = PathCacheLookup(File->FileSystem, NewFile->path);
+	DirEntry = PathCacheLookup(File->FileSystem, dirname);
+	if ((Entry == NULL) && (DirEntry != NULL) && DirEntry->Complete) {
+		/* We already saw everything this directory contains */
 		FreePool(NewFile->path);
 		GrubDestroyFile(NewFile);
-		return Status;
+		return EFI_NOT_FOUND;
+	} else if ((Entry != NULL) && !Entry->Exists) {
+		FreePool(NewFile->path);
+		GrubDestroyFile(NewFile);
+		return EFI_NOT_FOUND;
+	} else if (Entry != NULL) {
+		NewFile->IsDir = Entry->IsDir;
+		NewFile->Mtime = Entry->Mtime;
+	} else {
+		HookData.File = NewFile;
+		HookData.Found = FALSE;
+		HookData.Cached = TRUE;
+		if (strcmpa(dirname, "/") == 0)
+			PathCacheAdd(File->FileSystem, dirname, TRUE, TRUE, 0);
+		Evictions = File->FileSystem->PathCacheEvictions;
+		Status = GrubDir(NewFile, dirname, InfoHook, (VOID *) &HookData);
+		/*
+		 * If GRUB went through the whole directory without a match, and we
+		 * recorded (and kept) every entry it listed, later misses can be
+		 * answered without another walk.
+		 */
+		if (!EFI_ERROR(Status) && !HookData.Found && HookData.Cached &&
+			(File->FileSystem->PathCacheEvictions == Evictions)) {
+			DirEntry = PathCacheLookup(File->FileSystem, dirname);
+			if (DirEntry != NULL)
+				DirEntry->Complete = TRUE;
+		}
+		if (EFI_ERROR(Status)) {
+			if (Status != EFI_NOT_FOUND) {
+				PrintStatusError(Status, L"Could not get file attributes for '%s'", Name);
+			} else if (GrubIsFileNotFound()) {
+				PathCacheAdd(File->FileSystem, NewFile->path, FALSE, FALSE, 0);
+			}
+			FreePool(NewFile->path);
+			GrubDestroyFile(NewFile);
+			return Status;
+		}
 	}
 
 	/* Finally we can call on GRUB open() if it's a regular file */
 	if (!NewFile->IsDir) {
 		Status = GrubOpen(NewFile);
 		if (EFI_ERROR(Status)) {
-			if (Status != EFI_NOT_FOUND)
+			if (Status != EFI_NOT_FOUND) {
 				PrintStatusError(Status, L"Could not open file '%s'", Name);
+			} else if (GrubIsFileNotFound()) {
+				PathCacheAdd(File->FileSystem, NewFile->path, FALSE, FALSE, 0);
+			}
 			FreePool(NewFile->path);
 			GrubDestroyFile(NewFile);
 			return Status;
 		}
+		PathCacheSetSize(File->FileSystem, NewFile->path, GrubGetFileSize(NewFile));
 	}
 
 	NewFile->RefCount++;
@@ -211,6 +453,21 @@ FileOpenEx(EFI_FILE_HANDLE This, EFI_FILE_HANDLE *New, CHAR16 *Name,
 }
 
 
+/* Free the directory entries snapshot of a file */
+static VOID
+FreeDirEntries(EFI_GRUB_FILE *File)
+{
+	UINTN i;
+
+	for (i = 0; i < File->NumDirEntries; i++)
+		FreePool(File->DirEntries[i].Name);
+	if (File->DirEntries != NULL)
+		FreePool(File->DirEntries);
+	File->DirEntries = NULL;
+	File->NumDirEntries = 0;
+	File->MaxDirEntries = 0;
+}
+
 /**
  * Close file
  *
@@ -233,6 +490,7 @@ FileClose(EFI_FILE_HANDLE This)
 		/* Close the file if it's a regular one */
 		if (!File->IsDir)
 			GrubClose(File);
+		FreeDirEntries(File);
 		/* NB: basename points into File->path and does not need to be freed */
 		if (File->path != NULL)
 			FreePool(File->path);
@@ -264,50 +522,66 @@ FileDelete(EFI_FILE_HANDLE This)
 
 /* GRUB uses a callback for each directory entry, whereas EFI uses repeated
  * firmware generated calls to FileReadDir() to get the info for each entry,
- * so we have to reconcile the twos. For now, we'll re-issue a call to GRUB
- * dir(), and run through all the entries (to find the one we
- * are interested in) multiple times. Maybe later we'll try to optimize this
- * by building a one-off chained list of entries that we can parse...
+ * so we have to reconcile the twos. Rather than re-issuing a call to GRUB
+ * dir() for every entry, we take a snapshot of the directory entries when
+ * the caller starts (or restarts) reading the directory, and then serve
+ * the following calls from it.
+ * Since we go through all the entries anyway, we also record them in the
+ * path cache, so that opening them afterwards doesn't require another walk.
  */
+typedef struct {
+	EFI_GRUB_FILE *File;
+	CHAR8         *path;
+	CHAR8         *basename;
+	BOOLEAN       Cached;
+	BOOLEAN       Failed;
+} DIR_HOOK_DATA;
+
 static INT32
 DirHook(const CHAR8 *name, const GRUB_DIRHOOK_INFO *DirInfo, VOID *Data)
 {
-	EFI_STATUS Status;
-	EFI_FILE_INFO *Info = (EFI_FILE_INFO *) Data;
-	INT64 *Index = (INT64 *) &Info->FileSize;
-	UINTN tmpLen;
-	CHAR8 *filename = (CHAR8 *) (UINTN) Info->PhysicalSize;
-	EFI_TIME Time = { 1970, 01, 01, 00, 00, 00, 0, 0, 0, 0, 0};
+	DIR_HOOK_DATA *HookData = (DIR_HOOK_DATA *) Data;
+	EFI_GRUB_FILE *File = HookData->File;
+	EFI_DIR_ENTRY *Entry;
+	UINTN NewMax;
 
 	// Eliminate '.' or '..'
 	if ((name[0] ==  '.') && ((name[1] == 0) || ((name[1] == '.') && (name[2] == 0))))
 		return 0;
 
-	/* Ignore any entry that doesn't match our index */
-	if ((*Index)-- != 0)
-		return 0;
-
-	strcpya(filename, name);
-
-	tmpLen = (UINTN)(Info->Size - SIZE_OF_EFI_FILE_INFO);
-	Status = Utf8ToUtf16NoAllocUpdateLen(filename, Info->FileName, &tmpLen);
-	Info->Size = SIZE_OF_EFI_FILE_INFO + tmpLen;
-	if (EFI_ERROR(Status)) {
-		if (Status != EFI_BUFFER_TOO_SMALL)
-			PrintStatusError(Status, L"Could not convert directory entry to UTF-8");
-		return (INT32) Status;
+	if ((HookData->basename - HookData->path) + strlena(name) >= MAX_FILE_NAME_LEN) {
+		HookData->Cached = FALSE;
+	} else {
+		strcpya(HookData->basename, name);
+		/* A case insensitive listing can't be used to rule names out */
+		if (!PathCacheAdd(File->FileSystem, HookData->path, TRUE, (BOOLEAN) (DirInfo->Dir),
+				(DirInfo->MtimeSet) ? DirInfo->Mtime : 0) || (DirInfo->CaseInsensitive))
+			HookData->Cached = FALSE;
 	}
 
-	// Oh, and of course GRUB uses a 32 bit signed mtime value (seriously, wtf guys?!?)
-	if (DirInfo->MtimeSet)
-		GrubTimeToEfiTime(DirInfo->Mtime, &Time);
-	CopyMem(&Info->CreateTime, &Time, sizeof(Time));
-	CopyMem(&Info->LastAccessTime, &Time, sizeof(Time));
-	CopyMem(&Info->ModificationTime, &Time, sizeof(Time));
+	if (File->NumDirEntries >= File->MaxDirEntries) {
+		NewMax = (File->MaxDirEntries == 0) ? 64 : 2 * File->MaxDirEntries;
+		Entry = ReallocatePool(File->MaxDirEntries * sizeof(EFI_DIR_ENTRY),
+			NewMax * sizeof(EFI_DIR_ENTRY), File->DirEntries);
+		if (Entry == NULL) {
+			HookData->Failed = TRUE;
+			return 1;
+		}
+		File->DirEntries = Entry;
+		File->MaxDirEntries = NewMax;
+	}
 
-	Info->Attribute = EFI_FILE_READ_ONLY;
-	if (DirInfo->Dir)
-		Info->Attribute |= EFI_FILE_DIRECTORY;
+	Entry = &File->DirEntries[File->NumDirEntries];
+	Entry->Name = AllocatePool(strlena(name) + 1);
+	if (Entry->Name == NULL) {
+		HookData->Failed = TRUE;
+		return 1;
+	}
+	strcpya(Entry->Name, name);
+	Entry->IsDir = (BOOLEAN) (DirInfo->Dir);
+	Entry->MtimeSet = (BOOLEAN) (DirInfo->MtimeSet);
+	Entry->Mtime = DirInfo->Mtime;
+	File->NumDirEntries++;
 
 	return 0;
 }
@@ -325,12 +599,14 @@ FileReadDir(EFI_GRUB_FILE *File, UINTN *Len, VOID *Data)
 {
 	EFI_FILE_INFO *Info = (EFI_FILE_INFO *) Data;
 	EFI_STATUS Status;
-	/* We temporarily repurpose the FileSize as a *signed* entry index */
-	INT64 *Index = (INT64 *) &Info->FileSize;
-	/* And PhysicalSize as a pointer to our filename */
-	CHAR8 **basename = (CHAR8 **) &Info->PhysicalSize;
+	EFI_PATH_CACHE_ENTRY *DirEntry, *SizeEntry;
+	EFI_DIR_ENTRY *Entry;
+	DIR_HOOK_DATA HookData;
+	UINTN Evictions;
 	CHAR8 path[MAX_FILE_NAME_LEN];
 	EFI_GRUB_FILE *TmpFile = NULL;
+	EFI_TIME Time = { 1970, 01, 01, 00, 00, 00, 0, 0, 0, 0, 0};
+	UINTN tmpLen;
 	INTN len;
 
 	/* Unless we can fit our maximum size, forget it */
@@ -339,54 +615,100 @@ FileReadDir(EFI_GRUB_FILE *File, UINTN *Len, VOID *Data)
 		return EFI_BUFFER_TOO_SMALL;
 	}
 
-	/* Populate our Info template */
-	ZeroMem(Data, *Len);
-	Info->Size = *Len;
-	*Index = File->DirIndex;
 	strcpya(path, File->path);
 	len = strlena(path);
 	if (path[len-1] != '/')
 		path[len++] = '/';
-	*basename = &path[len];
+	path[len] = 0;
+
+	/* Take a snapshot of the directory entries if we're (re)starting */
+	if ((File->DirIndex == 0) || (File->DirEntries == NULL)) {
+		FreeDirEntries(File);
+		HookData.File = File;
+		HookData.path = path;
+		HookData.basename = &path[len];
+		HookData.Cached = TRUE;
+		HookData.Failed = FALSE;
+		if (IS_ROOT(File))
+			PathCacheAdd(File->FileSystem, File->path, TRUE, TRUE, 0);
+		Evictions = File->FileSystem->PathCacheEvictions;
+
+		/* Invoke GRUB's directory listing */
+		Status = GrubDir(File, File->path, DirHook, &HookData);
+		if (HookData.Failed)
+			Status = EFI_OUT_OF_RESOURCES;
+		if (EFI_ERROR(Status)) {
+			PrintStatusError(Status, L"Directory listing failed");
+			FreeDirEntries(File);
+			return Status;
+		}
+		if (HookData.Cached && (File->FileSystem->PathCacheEvictions == Evictions)) {
+			/* We now know everything this directory contains */
+			DirEntry = PathCacheLookup(File->FileSystem, File->path);
+			if (DirEntry != NULL)
+				DirEntry->Complete = TRUE;
+		}
+	}
 
-	/* Invoke GRUB's directory listing */
-	Status = GrubDir(File, File->path, DirHook, Data);
-	if (*Index >= 0) {
+	if ((File->DirIndex < 0) || ((UINT64) File->DirIndex >= File->NumDirEntries)) {
 		/* No more entries */
 		*Len = 0;
 		return EFI_SUCCESS;
 	}
+	Entry = &File->DirEntries[File->DirIndex];
 
+	/* Populate our Info */
+	ZeroMem(Data, *Len);
+	Info->Size = *Len;
+	tmpLen = (UINTN)(Info->Size - SIZE_OF_EFI_FILE_INFO);
+	Status = Utf8ToUtf16NoAllocUpdateLen(Entry->Name, Info->FileName, &tmpLen);
+	Info->Size = SIZE_OF_EFI_FILE_INFO + tmpLen;
 	if (EFI_ERROR(Status)) {
-		PrintStatusError(Status, L"Directory listing failed");
+		if (Status != EFI_BUFFER_TOO_SMALL)
+			PrintStatusError(Status, L"Could not convert directory entry to UTF-8");
 		return Status;
 	}
 
-	/* Our Index/FileSize must be reset */
-	Info->FileSize = 0;
-	Info->PhysicalSize = 0;
+	// Oh, and of course GRUB uses a 32 bit signed mtime value (seriously, wtf guys?!?)
+	if (Entry->MtimeSet)
+		GrubTimeToEfiTime(Entry->Mtime, &Time);
+	CopyMem(&Info->CreateTime, &Time, sizeof(Time));
+	CopyMem(&Info->LastAccessTime, &Time, sizeof(Time));
+	CopyMem(&Info->ModificationTime, &Time, sizeof(Time));
 
-	/* For regular files, we still need to fill the size */
-	if (!(Info->Attribute & EFI_FILE_DIRECTORY)) {
-		/* Open the file and read its size */
-		Status = GrubCreateFile(&TmpFile, File->FileSystem);
-		if (EFI_ERROR(Status)) {
-			PrintStatusError(Status, L"Unable to create temporary file");
-			return Status;
-		}
-		TmpFile->path = path;
+	Info->Attribute = EFI_FILE_READ_ONLY;
+	if (Entry->IsDir)
+		Info->Attribute |= EFI_FILE_DIRECTORY;
 
-		Status = GrubOpen(TmpFile);
-		if (EFI_ERROR(Status)) {
-			// TODO: EFI_NO_MAPPING is returned for links...
-			PrintStatusError(Status, L"Unable to obtain the size of '%s'", Info->FileName);
-			/* Non fatal error */
+	/* For regular files, we still need to fill the size */
+	if (!Entry->IsDir && (len + strlena(Entry->Name) < sizeof(path))) {
+		strcpya(&path[len], Entry->Name);
+		SizeEntry = PathCacheFind(File->FileSystem, path);
+		if ((SizeEntry != NULL) && SizeEntry->SizeSet) {
+			Info->FileSize = SizeEntry->Size;
+			Info->PhysicalSize = SizeEntry->Size;
 		} else {
-			Info->FileSize = GrubGetFileSize(TmpFile);
-			Info->PhysicalSize = GrubGetFileSize(TmpFile);
-			GrubClose(TmpFile);
+			/* Open the file and read its size */
+			Status = GrubCreateFile(&TmpFile, File->FileSystem);
+			if (EFI_ERROR(Status)) {
+				PrintStatusError(Status, L"Unable to create temporary file");
+				return Status;
+			}
+			TmpFile->path = path;
+
+			Status = GrubOpen(TmpFile);
+			if (EFI_ERROR(Status)) {
+				// TODO: EFI_NO_MAPPING is returned for links...
+				PrintStatusError(Status, L"Unable to obtain the size of '%s'", Info->FileName);
+				/* Non fatal error */
+			} else {
+				Info->FileSize = GrubGetFileSize(TmpFile);
+				Info->PhysicalSize = GrubGetFileSize(TmpFile);
+				PathCacheSetSize(File->FileSystem, path, Info->FileSize);
+				GrubClose(TmpFile);
+			}
+			GrubDestroyFile(TmpFile);
 		}
-		GrubDestroyFile(TmpFile);
 	}
 
 	*Len = (UINTN) Info->Size;
@@ -793,4 +1115,7 @@ FSUninstall(EFI_FS *This, EFI_HANDLE ControllerHandle)
 	BS->UninstallMultipleProtocolInterfaces(ControllerHandle,
 			&gEfiSimpleFileSystemProtocolGuid, &This->FileIoInterface,
 			NULL);
+
+	FreeDirEntries(This->RootFile);
+	PathCacheFree(This);
 }
@@ -305,6 +305,8 @@ GrubTimeToEfiTime(const INT32 t, EFI_TIME *tp)
 
 /* Need to reimplement a gcrypt compatible CRC32 for latest gzio.c
  * but heck if I'm going to lose 1 KB of space over it!
+ * The table is built once, when the driver is installed, rather than
+ * for every digest, since gzio runs a new one for each compressed block.
  * TODO: Move this to an EXTRAMODULE?
  */
 static grub_int32_t *crc32_table;
@@ -346,17 +348,6 @@ crc32_init(void *context, unsigned int flags __attribute__((unused)))
 {
 	CRC_CONTEXT *ctx = (CRC_CONTEXT *)context;
 	ctx->CRC = 0 ^ 0xffffffffL;
-
-	crc32_table = grub_malloc(256 * sizeof(grub_int32_t));
-	grub_uint32_t polynomial = 0x1edc6f41;
-	int i, j;
-	for (i = 0; i < 256; i++) {
-		crc32_table[i] = reflect(i, 8) << 24;
-		for (j = 0; j < 8; j++)
-			crc32_table[i] = (crc32_table[i] << 1) ^
-			(crc32_table[i] & (1 << 31) ? polynomial : 0);
-		crc32_table[i] = reflect(crc32_table[i], 32);
-	}
 }
 
 static void
@@ -384,7 +375,6 @@ crc32_final(void *context)
 	ctx->buf[1] = (ctx->CRC >> 16) & 0xFF;
 	ctx->buf[2] = (ctx->CRC >> 8) & 0xFF;
 	ctx->buf[3] = (ctx->CRC) & 0xFF;
-	grub_free(crc32_table);
 }
 
 gcry_md_spec_t _gcry_digest_spec_crc32 =
@@ -400,3 +390,32 @@ gcry_md_spec_t _gcry_digest_spec_crc32 =
 	.read = crc32_read,
 	.contextsize = sizeof(CRC_CONTEXT)
 };
+
+/* Set up whatever we keep around for the lifetime of the driver */
+EFI_STATUS
+GrubDriverInit(VOID)
+{
+	grub_uint32_t polynomial = 0x1edc6f41;
+	int i, j;
+
+	crc32_table = grub_malloc(256 * sizeof(grub_int32_t));
+	if (crc32_table == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	for (i = 0; i < 256; i++) {
+		crc32_table[i] = reflect(i, 8) << 24;
+		for (j = 0; j < 8; j++)
+			crc32_table[i] = (crc32_table[i] << 1) ^
+			(crc32_table[i] & (1 << 31) ? polynomial : 0);
+		crc32_table[i] = reflect(crc32_table[i], 32);
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Release whatever we kept around for the lifetime of the driver */
+VOID
+GrubDriverExit(VOID)
+{
+	grub_free(crc32_table);
+	crc32_table = NULL;
+}
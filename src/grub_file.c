@@ -32,6 +32,8 @@ grub_fs_t grub_fs_list = NULL;
 
 /* Keep track of the mounted filesystems */
 LIST_ENTRY FsListHead;
+/* And of the volumes that may be members of one */
+LIST_ENTRY FsCandidateListHead;
 
 grub_file_filter_t grub_file_filters_all[GRUB_FILE_FILTER_MAX];
 grub_file_filter_t grub_file_filters_enabled[GRUB_FILE_FILTER_MAX];
@@ -127,46 +129,319 @@ grub_file_seek(grub_file_t file, grub_off_t offset)
 int
 grub_device_iterate(grub_device_iterate_hook_t hook, void *hook_data)
 {
-	PrintError(L"grub_device_iterate() called\n");
+	EFI_FS *FileSystem, *Next;
+	EFI_FS_CANDIDATE *Candidate, *NextCandidate;
+
+	/*
+	 * Multi device file systems, such as Btrfs or ZFS, use this to scan for
+	 * their other members. Our candidates are the volumes we have bound,
+	 * which includes the one currently being probed, as well as the ones
+	 * that failed to probe on their own, which is what a member that doesn't
+	 * hold the part of the file system GRUB needs to mount it looks like.
+	 * Since our device names are device paths, they can be fed straight to
+	 * grub_device_open().
+	 */
+	for (FileSystem = (EFI_FS *) FORWARD_LINK_REF(FsListHead); FileSystem != (EFI_FS *) &FsListHead;
+			FileSystem = Next) {
+		Next = (EFI_FS *) FileSystem->Flink;
+		if (hook((const char *) FileSystem->DevicePath, hook_data))
+			return 1;
+	}
+	for (Candidate = (EFI_FS_CANDIDATE *) FORWARD_LINK_REF(FsCandidateListHead);
+			Candidate != (EFI_FS_CANDIDATE *) &FsCandidateListHead; Candidate = NextCandidate) {
+		NextCandidate = (EFI_FS_CANDIDATE *) Candidate->Flink;
+		if (hook((const char *) Candidate->DevicePath, hook_data))
+			return 1;
+	}
 	return 0;
 }
 
+static EFI_FS_CANDIDATE *
+FindCandidate(CONST EFI_DEVICE_PATH *DevicePath)
+{
+	EFI_FS_CANDIDATE *Candidate;
+
+	for (Candidate = (EFI_FS_CANDIDATE *) FORWARD_LINK_REF(FsCandidateListHead);
+			Candidate != (EFI_FS_CANDIDATE *) &FsCandidateListHead;
+			Candidate = (EFI_FS_CANDIDATE *) Candidate->Flink) {
+		if (CompareDevicePaths(Candidate->DevicePath, DevicePath) == 0)
+			return Candidate;
+	}
+	return NULL;
+}
+
+static VOID
+FreeCandidate(EFI_FS_CANDIDATE *Candidate)
+{
+	RemoveEntryList((LIST_ENTRY *) Candidate);
+	FreePool(Candidate->DevicePath);
+	FreePool(Candidate);
+}
+
+/* Keep track of a volume we couldn't mount, for multi device scans */
+VOID
+GrubAddCandidate(EFI_FS *FileSystem)
+{
+	EFI_FS_CANDIDATE *Candidate;
+
+	if (FindCandidate(FileSystem->DevicePath) != NULL)
+		return;
+
+	Candidate = AllocateZeroPool(sizeof(EFI_FS_CANDIDATE));
+	if (Candidate == NULL)
+		return;
+	/* The device path from the handle may go away with the handle */
+	Candidate->DevicePath = DuplicateDevicePath(FileSystem->DevicePath);
+	if (Candidate->DevicePath == NULL) {
+		FreePool(Candidate);
+		return;
+	}
+	InsertTailList(&FsCandidateListHead, (LIST_ENTRY *) Candidate);
+}
+
+VOID
+GrubFreeCandidates(VOID)
+{
+	while (FORWARD_LINK_REF(FsCandidateListHead) != &FsCandidateListHead)
+		FreeCandidate((EFI_FS_CANDIDATE *) FORWARD_LINK_REF(FsCandidateListHead));
+}
+
+/*
+ * Set up a read only instance for a candidate volume, which is only kept
+ * for as long as GRUB has the device open. We don't own the DiskIo of that
+ * volume, so we only ever get its protocols, which is fine since we don't
+ * write to it.
+ */
+static EFI_FS *
+OpenCandidate(EFI_DEVICE_PATH *DevicePath)
+{
+	EFI_STATUS Status;
+	EFI_FS_CANDIDATE *Candidate;
+	EFI_DEVICE_PATH *RemainingDevicePath;
+	EFI_HANDLE Handle;
+	EFI_FS *FileSystem;
+
+	Candidate = FindCandidate(DevicePath);
+	if (Candidate == NULL)
+		return NULL;
+
+	RemainingDevicePath = Candidate->DevicePath;
+	Status = BS->LocateDevicePath(&gEfiDiskIoProtocolGuid, &RemainingDevicePath, &Handle);
+	if (EFI_ERROR(Status) || !IsDevicePathEnd(RemainingDevicePath)) {
+		/* The volume is gone */
+		FreeCandidate(Candidate);
+		return NULL;
+	}
+
+	FileSystem = AllocateZeroPool(sizeof(EFI_FS));
+	if (FileSystem == NULL)
+		return NULL;
+	FileSystem->IsCandidate = TRUE;
+	FileSystem->DevicePath = Candidate->DevicePath;
+	InitializeListHead(&FileSystem->WindowPool);
+	InitializeListHead(&FileSystem->ExtentMaps);
+
+	Status = BS->OpenProtocol(Handle, &gEfiBlockIoProtocolGuid, (VOID **) &FileSystem->BlockIo,
+			EfiImageHandle, Handle, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	if (!EFI_ERROR(Status))
+		Status = BS->OpenProtocol(Handle, &gEfiDiskIoProtocolGuid, (VOID **) &FileSystem->DiskIo,
+				EfiImageHandle, Handle, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	if (EFI_ERROR(Status)) {
+		PrintStatusError(Status, L"Could not access candidate volume");
+		FreePool(FileSystem);
+		return NULL;
+	}
+	if (EFI_ERROR(BS->OpenProtocol(Handle, &gEfiBlockIo2ProtocolGuid, (VOID **) &FileSystem->BlockIo2,
+			EfiImageHandle, Handle, EFI_OPEN_PROTOCOL_GET_PROTOCOL)))
+		FileSystem->BlockIo2 = NULL;
+	FileSystem->MediaId = FileSystem->BlockIo->Media->MediaId;
+
+	return FileSystem;
+}
+
 grub_disk_read_hook_t grub_file_progress_hook = NULL;
 
+static EFI_STATUS
+DiskRead(EFI_FS *FileSystem, UINT64 Address, UINTN Size, VOID *Buf)
+{
+	EFI_BLOCK_IO_MEDIA *Media = FileSystem->BlockIo->Media;
+	UINT32 BlockSize = Media->BlockSize;
+	UINTN Shift;
+
+	/*
+	 * Block aligned reads, which is what we get for file data we know the
+	 * location of, can go to the block device directly, in one request,
+	 * rather than through DiskIo, which would split and relay them anyway.
+	 * We only do so for power of two block sizes, so that we can get the
+	 * LBA without a 64-bit division, which 32-bit targets can't link.
+	 */
+	if ((BlockSize != 0) && ((BlockSize & (BlockSize - 1)) == 0) &&
+		((Address & (BlockSize - 1)) == 0) && ((Size & (BlockSize - 1)) == 0) &&
+		((Media->IoAlign <= 1) || ((UINTN) Buf % Media->IoAlign == 0))) {
+		for (Shift = 0; (1U << Shift) < BlockSize; Shift++);
+		return FileSystem->BlockIo->ReadBlocks(FileSystem->BlockIo, Media->MediaId,
+			RShiftU64(Address, Shift), Size, Buf);
+	}
+
+	if (FileSystem->BlockIo2 != NULL)
+		Media = FileSystem->BlockIo2->Media;
+	if (FileSystem->DiskIo2 != NULL)
+		return FileSystem->DiskIo2->ReadDiskEx(FileSystem->DiskIo2, Media->MediaId,
+			Address, &(FileSystem->DiskIo2Token), Size, Buf);
+	return FileSystem->DiskIo->ReadDisk(FileSystem->DiskIo, Media->MediaId,
+		Address, Size, Buf);
+}
+
+/*
+ * GRUB file system drivers tend to issue a lot of small reads for their
+ * metadata (e.g. 4 bytes at a time for each FAT entry), which GRUB's disk.c
+ * normally caches. Since we bypass it, we use our own little cache for these.
+ * Also, since GRUB mounts the file system anew for each call, and reads the
+ * same small structures again when it does, the cache is set associative,
+ * with LRU replacement, so that a frequently used unit doesn't get evicted
+ * just because another one maps to the same slot.
+ */
+/* Returns the cache entry holding Unit or, if there's none, the one to evict for it */
+static EFI_DISK_CACHE_ENTRY *
+DiskCacheEntry(EFI_FS *FileSystem, UINT64 Unit)
+{
+	EFI_DISK_CACHE_ENTRY *Set, *Entry;
+	UINTN i;
+
+	Set = &FileSystem->DiskCache[(Unit % (DISK_CACHE_NUM_UNITS / DISK_CACHE_WAYS)) * DISK_CACHE_WAYS];
+	Entry = &Set[0];
+	for (i = 0; i < DISK_CACHE_WAYS; i++) {
+		if (Set[i].Unit == Unit)
+			return &Set[i];
+		if (Set[i].LastUsed < Entry->LastUsed)
+			Entry = &Set[i];
+	}
+	return Entry;
+}
+
+static EFI_STATUS
+DiskCacheRead(EFI_FS *FileSystem, UINT64 Address, UINTN Size, CHAR8 *Buf)
+{
+	EFI_STATUS Status;
+	EFI_DISK_CACHE_ENTRY *Entry;
+	UINT64 Unit, UnitAddress, VolumeSize;
+	UINTN i, Offset, Len;
+	CHAR8 *Data;
+
+	if (FileSystem->DiskCache == NULL) {
+		FileSystem->DiskCacheData = AllocatePool(DISK_CACHE_NUM_UNITS * DISK_CACHE_UNIT_SIZE);
+		if (FileSystem->DiskCacheData == NULL)
+			return DiskRead(FileSystem, Address, Size, Buf);
+		FileSystem->DiskCache = AllocatePool(DISK_CACHE_NUM_UNITS * sizeof(EFI_DISK_CACHE_ENTRY));
+		if (FileSystem->DiskCache == NULL) {
+			FreePool(FileSystem->DiskCacheData);
+			FileSystem->DiskCacheData = NULL;
+			return DiskRead(FileSystem, Address, Size, Buf);
+		}
+		for (i = 0; i < DISK_CACHE_NUM_UNITS; i++) {
+			FileSystem->DiskCache[i].Unit = (UINT64)-1;
+			FileSystem->DiskCache[i].LastUsed = 0;
+		}
+	}
+
+	if (FileSystem->BlockIo2 != NULL) {
+		VolumeSize = (FileSystem->BlockIo2->Media->LastBlock + 1) *
+			FileSystem->BlockIo2->Media->BlockSize;
+	} else {
+		VolumeSize = (FileSystem->BlockIo->Media->LastBlock + 1) *
+			FileSystem->BlockIo->Media->BlockSize;
+	}
+	if ((Address >= VolumeSize) || (Size > VolumeSize - Address))
+		return EFI_INVALID_PARAMETER;
+
+	while (Size > 0) {
+		Unit = Address / DISK_CACHE_UNIT_SIZE;
+		UnitAddress = Unit * DISK_CACHE_UNIT_SIZE;
+		Entry = DiskCacheEntry(FileSystem, Unit);
+		Data = &FileSystem->DiskCacheData[(Entry - FileSystem->DiskCache) * DISK_CACHE_UNIT_SIZE];
+		if (Entry->Unit != Unit) {
+			Entry->Unit = (UINT64)-1;
+			Status = DiskRead(FileSystem, UnitAddress,
+				(UINTN) MIN((UINT64) DISK_CACHE_UNIT_SIZE, VolumeSize - UnitAddress), Data);
+			if (EFI_ERROR(Status))
+				return Status;
+			Entry->Unit = Unit;
+		}
+		Entry->LastUsed = ++FileSystem->DiskCacheTick;
+		Offset = (UINTN)(Address - UnitAddress);
+		Len = MIN(Size, DISK_CACHE_UNIT_SIZE - Offset);
+		CopyMem(Buf, &Data[Offset], Len);
+		Address += Len;
+		Buf += Len;
+		Size -= Len;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * GRUB's file system drivers set the disk read hook for the reads that go
+ * straight from the disk into the file buffer. We use that to find out where
+ * the file data lives on disk, so that further reads of the same region can
+ * be issued directly, as one device read per contiguous run, rather than go
+ * through the GRUB block mapping again. This is especially useful with NTFS,
+ * where GRUB re-parses the run list every time.
+ */
+typedef struct {
+	EFI_GRUB_FILE          *File;
+	CHAR8                  *Buf;
+	UINT64                  Offset;
+	UINTN                   Len;
+	EFI_GRUB_EXTENT        *Runs;
+	UINTN                   NumRuns;
+	UINTN                   MaxRuns;
+	BOOLEAN                 Failed;
+} EXTENT_HOOK_DATA;
+
+static grub_err_t ExtentHook(grub_disk_addr_t sector, unsigned offset,
+		unsigned length, char *buf, void *data);
+
 grub_err_t
 grub_disk_read(grub_disk_t disk, grub_disk_addr_t sector,
 		grub_off_t offset, grub_size_t size, void *buf)
 {
 	EFI_STATUS Status;
 	EFI_FS* FileSystem = (EFI_FS *) disk->data;
-	EFI_BLOCK_IO_MEDIA *Media;
+	UINT64 Address;
 
 	FS_ASSERT(FileSystem != NULL);
 	FS_ASSERT(FileSystem->DiskIo != NULL);
 	FS_ASSERT(FileSystem->BlockIo != NULL);
 
-	if (FileSystem->BlockIo2 != NULL) {
-		Media = FileSystem->BlockIo2->Media;
-	} else {
-		Media = FileSystem->BlockIo->Media;
-	}
+	GrubCheckMedia(FileSystem);
 
 	/* NB: We could get the actual blocksize through FileSystem->BlockIo->Media->BlockSize
 	 * but GRUB uses the fixed GRUB_DISK_SECTOR_SIZE, so we follow suit
 	 */
-	if (FileSystem->DiskIo2 != NULL) {
-		Status = FileSystem->DiskIo2->ReadDiskEx(FileSystem->DiskIo2, Media->MediaId,
-			sector * GRUB_DISK_SECTOR_SIZE + offset, &(FileSystem->DiskIo2Token), size, buf);
-	} else {
-		Status = FileSystem->DiskIo->ReadDisk(FileSystem->DiskIo, Media->MediaId,
-			sector * GRUB_DISK_SECTOR_SIZE + offset, (UINTN)size, buf);
-	}
+	Address = sector * GRUB_DISK_SECTOR_SIZE + offset;
+	if (size < DISK_CACHE_UNIT_SIZE)
+		Status = DiskCacheRead(FileSystem, Address, (UINTN)size, (CHAR8 *) buf);
+	else
+		Status = DiskRead(FileSystem, Address, (UINTN)size, buf);
 
 	if (EFI_ERROR(Status)) {
 		PrintStatusError(Status, L"Could not read block at address %08x", sector);
 		return grub_error (GRUB_ERR_READ_ERROR, N_("Could not read block"));
 	}
 
+	/* Like GRUB's disk.c, let the read hook know where the data came from.
+	 * Unlike GRUB, we do it in one go, rather than for each sector.
+	 * Our extent hook only maps reads from the disk the file lives on, and
+	 * not the ones a multi device file system makes from its other members.
+	 */
+	if ((disk->read_hook == ExtentHook) &&
+		(((EXTENT_HOOK_DATA *) disk->read_hook_data)->File->FileSystem != FileSystem))
+		return 0;
+	if (disk->read_hook != NULL)
+		(disk->read_hook)(sector + (offset >> GRUB_DISK_SECTOR_BITS),
+			(unsigned)(offset & (GRUB_DISK_SECTOR_SIZE - 1)), (unsigned)size,
+			(char *) buf, disk->read_hook_data);
+
 	return 0;
 }
 
@@ -223,16 +498,19 @@ grub_device_open(const char *name)
 		if (CompareDevicePaths(FileSystem->DevicePath, DevicePath) == 0)
 			break;
 	}
-	if (FileSystem == (EFI_FS *) &FsListHead)
-		return NULL;
+	if (FileSystem == (EFI_FS *) &FsListHead) {
+		FileSystem = OpenCandidate(DevicePath);
+		if (FileSystem == NULL)
+			return NULL;
+	}
 
 	device = grub_zalloc(sizeof(struct grub_device));
 	if (device == NULL)
-		return NULL;
+		goto error;
 	device->disk = grub_zalloc(sizeof(struct grub_disk));
 	if (device->disk == NULL) {
 		grub_free(device);
-		return NULL;
+		goto error;
 	}
 	/* The private disk data is a pointer back to our EFI_FS */
 	device->disk->data = (void *) FileSystem;
@@ -242,25 +520,319 @@ grub_device_open(const char *name)
 	 */
 
 	return device;
+
+error:
+	if (FileSystem->IsCandidate)
+		FreePool(FileSystem);
+	return NULL;
 }
 
 grub_err_t
 grub_device_close(grub_device_t device)
 {
+	EFI_FS *FileSystem;
+
 	FS_ASSERT(device != NULL);
 
+	FileSystem = (EFI_FS *) device->disk->data;
+	if (FileSystem->IsCandidate) {
+		if (FileSystem->DiskCache != NULL)
+			FreePool(FileSystem->DiskCache);
+		if (FileSystem->DiskCacheData != NULL)
+			FreePool(FileSystem->DiskCacheData);
+		FreePool(FileSystem);
+	}
 	grub_free(device->disk);
 	grub_free(device);
 	return 0;
 }
 
+/*
+ * Read windows are kept in a per volume pool once a file is done with them,
+ * so that data GRUB had to decode (e.g. a compressed extent) can be served
+ * again, without having to be decoded anew, to any handle that reads it.
+ * The pool is kept in LRU order, and its size can be set, in KB, through
+ * the FS_CACHE_SIZE shell variable. Windows are also hashed by path, with
+ * each bucket in MRU order, so that looking up the windows of a file only
+ * goes through the ones of files that share its bucket.
+ */
+static VOID
+FreeWindow(EFI_READ_WINDOW *Window)
+{
+	if (Window->Data != NULL)
+		FreePool(Window->Data);
+	FreePool(Window);
+}
+
+static VOID
+RemoveWindow(EFI_FS *FileSystem, EFI_READ_WINDOW *Window)
+{
+	RemoveEntryList((LIST_ENTRY *) Window);
+	RemoveEntryList(&Window->Bucket);
+	FileSystem->WindowPoolSize -= Window->AllocSize;
+}
+
+static VOID
+ReleaseWindow(EFI_FS *FileSystem, EFI_READ_WINDOW *Window)
+{
+	EFI_READ_WINDOW *Lru;
+	LIST_ENTRY *Bucket, *Link, *Next;
+	UINTN FileSize = 0;
+
+	if ((Window->Size == 0) || (Window->AllocSize > FileSystem->WindowPoolMax)) {
+		FreeWindow(Window);
+		return;
+	}
+
+	Bucket = &FileSystem->WindowBuckets[Window->Hash % WINDOW_POOL_BUCKETS];
+	InsertHeadList(&FileSystem->WindowPool, (LIST_ENTRY *) Window);
+	InsertHeadList(Bucket, &Window->Bucket);
+	FileSystem->WindowPoolSize += Window->AllocSize;
+
+	/*
+	 * A single file may only use part of the pool, so that streaming
+	 * through a large file, or seeking all over it, doesn't flush the
+	 * windows of every other file.
+	 */
+	for (Link = Window->Bucket.Flink; Link != Bucket; Link = Next) {
+		Next = Link->Flink;
+		Lru = _CR(Link, EFI_READ_WINDOW, Bucket);
+		if ((Lru->Hash != Window->Hash) || (strcmpa(Lru->Path, Window->Path) != 0))
+			continue;
+		FileSize += Lru->AllocSize;
+		if (FileSize + Window->AllocSize > FileSystem->WindowPoolMax / WINDOW_POOL_FILE_SHARE) {
+			RemoveWindow(FileSystem, Lru);
+			FreeWindow(Lru);
+		}
+	}
+
+	/* The extent maps are charged to the same budget, but never exceed a share of it */
+	while ((FileSystem->WindowPoolSize + FileSystem->ExtentMapsSize > FileSystem->WindowPoolMax) &&
+			(FORWARD_LINK_REF(FileSystem->WindowPool) != &FileSystem->WindowPool)) {
+		Lru = (EFI_READ_WINDOW *) BACKWARD_LINK_REF(FileSystem->WindowPool);
+		RemoveWindow(FileSystem, Lru);
+		FreeWindow(Lru);
+	}
+}
+
+static EFI_READ_WINDOW *
+AcquireWindow(EFI_FS *FileSystem, const CHAR8 *Path, UINT64 Offset)
+{
+	EFI_READ_WINDOW *Window;
+	LIST_ENTRY *Bucket, *Link;
+	UINT32 Hash = PathHash(Path);
+
+	Bucket = &FileSystem->WindowBuckets[Hash % WINDOW_POOL_BUCKETS];
+	for (Link = Bucket->Flink; Link != Bucket; Link = Link->Flink) {
+		Window = _CR(Link, EFI_READ_WINDOW, Bucket);
+		if ((Offset >= Window->Offset) && (Offset < Window->Offset + Window->Size) &&
+			(Window->Hash == Hash) && (strcmpa(Window->Path, Path) == 0)) {
+			RemoveWindow(FileSystem, Window);
+			return Window;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Mapping the extents of a file can take many GRUB reads, with each of them
+ * having to go through the file system metadata (e.g. the UDF allocation
+ * descriptors and their extension chains). So, when a file is closed, we
+ * keep its extents in a per volume list, in LRU order, and hand them back
+ * to the next handle that opens the same file. The maps are hashed by path,
+ * like the read windows, and count against the same FS_CACHE_SIZE budget,
+ * of which they may use up to a fourth.
+ */
+static VOID
+FreeExtentMap(EFI_EXTENT_MAP *Map)
+{
+	if (Map->Extents != NULL)
+		FreePool(Map->Extents);
+	FreePool(Map);
+}
+
+static VOID
+RemoveExtentMap(EFI_FS *FileSystem, EFI_EXTENT_MAP *Map)
+{
+	RemoveEntryList((LIST_ENTRY *) Map);
+	RemoveEntryList(&Map->Bucket);
+	FileSystem->ExtentMapsSize -= Map->AllocSize;
+}
+
+static EFI_EXTENT_MAP *
+FindExtentMap(EFI_FS *FileSystem, const CHAR8 *Path)
+{
+	EFI_EXTENT_MAP *Map;
+	LIST_ENTRY *Bucket, *Link;
+	UINT32 Hash = PathHash(Path);
+
+	Bucket = &FileSystem->ExtentMapBuckets[Hash % EXTENT_MAP_BUCKETS];
+	for (Link = Bucket->Flink; Link != Bucket; Link = Link->Flink) {
+		Map = _CR(Link, EFI_EXTENT_MAP, Bucket);
+		if ((Map->Hash == Hash) && (strcmpa(Map->Path, Path) == 0)) {
+			RemoveExtentMap(FileSystem, Map);
+			return Map;
+		}
+	}
+	return NULL;
+}
+
+static VOID
+StoreExtentMap(EFI_GRUB_FILE *File)
+{
+	EFI_FS *FileSystem = File->FileSystem;
+	grub_file_t f = (grub_file_t) File->GrubFile;
+	EFI_EXTENT_MAP *Map;
+	EFI_READ_WINDOW *Window;
+	UINTN PathLen, AllocSize;
+
+	if ((File->NumExtents == 0) || (File->path == NULL))
+		return;
+
+	/* Whatever an older handle left for this file is superseded */
+	Map = FindExtentMap(FileSystem, File->path);
+	if (Map != NULL)
+		FreeExtentMap(Map);
+
+	PathLen = strlena(File->path);
+	AllocSize = sizeof(EFI_EXTENT_MAP) + PathLen + File->MaxExtents * sizeof(EFI_GRUB_EXTENT);
+	if (AllocSize > FileSystem->WindowPoolMax / EXTENT_MAP_POOL_SHARE)
+		return;
+	while (FileSystem->ExtentMapsSize + AllocSize > FileSystem->WindowPoolMax / EXTENT_MAP_POOL_SHARE) {
+		Map = (EFI_EXTENT_MAP *) BACKWARD_LINK_REF(FileSystem->ExtentMaps);
+		RemoveExtentMap(FileSystem, Map);
+		FreeExtentMap(Map);
+	}
+
+	Map = AllocateZeroPool(sizeof(EFI_EXTENT_MAP) + PathLen);
+	if (Map == NULL)
+		return;
+	CopyMem(Map->Path, File->path, PathLen + 1);
+	Map->Hash = PathHash(File->path);
+	Map->AllocSize = AllocSize;
+	Map->Extents = File->Extents;
+	Map->NumExtents = File->NumExtents;
+	Map->MaxExtents = File->MaxExtents;
+	Map->FileSize = (UINT64) f->size;
+	File->Extents = NULL;
+	File->NumExtents = 0;
+	File->MaxExtents = 0;
+
+	InsertHeadList(&FileSystem->ExtentMaps, (LIST_ENTRY *) Map);
+	InsertHeadList(&FileSystem->ExtentMapBuckets[Map->Hash % EXTENT_MAP_BUCKETS], &Map->Bucket);
+	FileSystem->ExtentMapsSize += AllocSize;
+
+	/* Make room in the window pool, which shares the budget */
+	while ((FileSystem->WindowPoolSize + FileSystem->ExtentMapsSize > FileSystem->WindowPoolMax) &&
+			(FORWARD_LINK_REF(FileSystem->WindowPool) != &FileSystem->WindowPool)) {
+		Window = (EFI_READ_WINDOW *) BACKWARD_LINK_REF(FileSystem->WindowPool);
+		RemoveWindow(FileSystem, Window);
+		FreeWindow(Window);
+	}
+}
+
+static VOID
+LoadExtentMap(EFI_GRUB_FILE *File)
+{
+	grub_file_t f = (grub_file_t) File->GrubFile;
+	EFI_EXTENT_MAP *Map;
+
+	if ((File->Extents != NULL) || (File->path == NULL))
+		return;
+
+	Map = FindExtentMap(File->FileSystem, File->path);
+	if (Map == NULL)
+		return;
+	if (Map->FileSize != (UINT64) f->size) {
+		FreeExtentMap(Map);
+		return;
+	}
+	File->Extents = Map->Extents;
+	File->NumExtents = Map->NumExtents;
+	File->MaxExtents = Map->MaxExtents;
+	FreePool(Map);
+}
+
+static VOID
+FlushWindowPool(EFI_FS *FileSystem)
+{
+	EFI_READ_WINDOW *Window;
+
+	while (FORWARD_LINK_REF(FileSystem->WindowPool) != &FileSystem->WindowPool) {
+		Window = (EFI_READ_WINDOW *) FORWARD_LINK_REF(FileSystem->WindowPool);
+		RemoveWindow(FileSystem, Window);
+		FreeWindow(Window);
+	}
+	FileSystem->WindowPoolSize = 0;
+}
+
+static VOID
+FlushExtentMaps(EFI_FS *FileSystem)
+{
+	EFI_EXTENT_MAP *Map;
+
+	while (FORWARD_LINK_REF(FileSystem->ExtentMaps) != &FileSystem->ExtentMaps) {
+		Map = (EFI_EXTENT_MAP *) FORWARD_LINK_REF(FileSystem->ExtentMaps);
+		RemoveExtentMap(FileSystem, Map);
+		FreeExtentMap(Map);
+	}
+}
+
+/*
+ * Everything we cache for a volume is only valid for the media it was read
+ * from. So, if the media was changed underneath us, drop it all.
+ */
+VOID
+GrubCheckMedia(EFI_FS *FileSystem)
+{
+	UINTN i;
+
+	if (FileSystem->BlockIo->Media->MediaId == FileSystem->MediaId)
+		return;
+
+	PrintInfo(L"Media change detected - flushing the caches\n");
+	FileSystem->MediaId = FileSystem->BlockIo->Media->MediaId;
+	if (FileSystem->DiskCache != NULL) {
+		for (i = 0; i < DISK_CACHE_NUM_UNITS; i++)
+			FileSystem->DiskCache[i].Unit = (UINT64)-1;
+	}
+	FlushWindowPool(FileSystem);
+	FlushExtentMaps(FileSystem);
+	PathCacheFree(FileSystem);
+	/* Keep any directory listing in progress from being marked complete */
+	FileSystem->PathCacheEvictions++;
+}
+
 EFI_STATUS
 GrubDeviceInit(EFI_FS *FileSystem)
 {
+	EFI_STATUS Status;
+	CHAR16 CacheVar[12];
+	UINTN CacheVarSize = sizeof(CacheVar);
+	EFI_FS_CANDIDATE *Candidate;
+	UINTN i;
+
 	FS_ASSERT(FileSystem->DevicePath != NULL);
 
+	FileSystem->MediaId = FileSystem->BlockIo->Media->MediaId;
+	InitializeListHead(&FileSystem->ExtentMaps);
+	for (i = 0; i < EXTENT_MAP_BUCKETS; i++)
+		InitializeListHead(&FileSystem->ExtentMapBuckets[i]);
+	FileSystem->ExtentMapsSize = 0;
+	InitializeListHead(&FileSystem->WindowPool);
+	for (i = 0; i < WINDOW_POOL_BUCKETS; i++)
+		InitializeListHead(&FileSystem->WindowBuckets[i]);
+	FileSystem->WindowPoolSize = 0;
+	FileSystem->WindowPoolMax = WINDOW_POOL_SIZE;
+	Status = RT->GetVariable(L"FS_CACHE_SIZE", &ShellVariable, NULL, &CacheVarSize, CacheVar);
+	if (Status == EFI_SUCCESS)
+		FileSystem->WindowPoolMax = (UINTN) Atoi(CacheVar) * 1024;
+
 	/* Insert this filesystem in our list */
 	InsertTailList(&FsListHead, (LIST_ENTRY *) FileSystem);
+	Candidate = FindCandidate(FileSystem->DevicePath);
+	if (Candidate != NULL)
+		FreeCandidate(Candidate);
 
 	FileSystem->GrubDevice = (VOID *) grub_device_open((const char *)FileSystem->DevicePath);
 
@@ -278,6 +850,17 @@ GrubDeviceExit(EFI_FS *FileSystem)
 	grub_device_close((grub_device_t) FileSystem->GrubDevice);
 	RemoveEntryList((LIST_ENTRY *)FileSystem);
 
+	if (FileSystem->DiskCache != NULL)
+		FreePool(FileSystem->DiskCache);
+	if (FileSystem->DiskCacheData != NULL)
+		FreePool(FileSystem->DiskCacheData);
+	FileSystem->DiskCache = NULL;
+	FileSystem->DiskCacheData = NULL;
+
+	FileSystem->WindowPoolMax = 0;
+	FlushWindowPool(FileSystem);
+	FlushExtentMaps(FileSystem);
+
 	return EFI_SUCCESS;
 }
 
@@ -298,6 +881,7 @@ GrubCreateFile(EFI_GRUB_FILE **File, EFI_FS *FileSystem)
 
 	/* Initialize the attributes */
 	NewFile->FileSystem = FileSystem;
+	NewFile->MediaId = FileSystem->MediaId;
 	FS_ASSERT(FileSystem->RootFile != NULL);
 	CopyMem(&NewFile->EfiFile, &FileSystem->RootFile->EfiFile, sizeof(EFI_FILE));
 
@@ -316,6 +900,10 @@ GrubDestroyFile(EFI_GRUB_FILE *File)
 		return;
 	if (File->GrubFile != NULL)
 		FreePool(File->GrubFile);
+	if (File->Extents != NULL)
+		FreePool(File->Extents);
+	if (File->Window != NULL)
+		FreeWindow(File->Window);
 	FreePool(File);
 }
 
@@ -343,6 +931,9 @@ GrubSetFileOffset(EFI_GRUB_FILE *File, UINT64 Offset)
 /*
  * The following provides an EFI interface for each basic GRUB fs call
  */
+/* The GRUB error from the last open or directory lookup */
+static grub_err_t LastGrubError = GRUB_ERR_NONE;
+
 EFI_STATUS
 GrubDir(EFI_GRUB_FILE *File, const CHAR8 *path,
 		GRUB_DIRHOOK Hook, VOID *HookData)
@@ -353,6 +944,7 @@ GrubDir(EFI_GRUB_FILE *File, const CHAR8 *path,
 
 	grub_errno = 0;
 	rc = p->fs_dir(f->device, path, (grub_fs_dir_hook_t) Hook, HookData);
+	LastGrubError = rc;
 	return GrubErrToEFIStatus(rc);
 }
 
@@ -365,9 +957,24 @@ GrubOpen(EFI_GRUB_FILE *File)
 
 	grub_errno = 0;
 	rc = p->fs_open(f, File->path);
+	if (rc == GRUB_ERR_NONE)
+		LoadExtentMap(File);
+	LastGrubError = rc;
 	return GrubErrToEFIStatus(rc);
 }
 
+/*
+ * GRUB errors such as GRUB_ERR_UNKNOWN_FS also translate to EFI_NOT_FOUND,
+ * so this tells whether the last GrubOpen() or GrubDir() call failed because
+ * the path is missing. We can't use grub_errno for that, as printing the
+ * error, when converting it, resets it.
+ */
+BOOLEAN
+GrubIsFileNotFound(VOID)
+{
+	return (LastGrubError == GRUB_ERR_FILE_NOT_FOUND);
+}
+
 VOID
 GrubClose(EFI_GRUB_FILE *File)
 {
@@ -376,15 +983,255 @@ GrubClose(EFI_GRUB_FILE *File)
 
 	grub_errno = 0;
 	p->fs_close(f);
+
+	if (File->Window != NULL)
+		ReleaseWindow(File->FileSystem, File->Window);
+	File->Window = NULL;
+	StoreExtentMap(File);
+}
+
+/* Return the index of the first extent that ends after Offset */
+static UINTN
+FindExtent(EFI_GRUB_FILE *File, UINT64 Offset)
+{
+	UINTN Low = 0, High = File->NumExtents, Mid;
+
+	while (Low < High) {
+		Mid = (Low + High) / 2;
+		if (File->Extents[Mid].Offset + File->Extents[Mid].Length <= Offset)
+			Low = Mid + 1;
+		else
+			High = Mid;
+	}
+	return Low;
+}
+
+static VOID
+AddExtent(EFI_GRUB_FILE *File, EFI_GRUB_EXTENT *Run)
+{
+	EFI_GRUB_EXTENT *Prev, *Next, *NewExtents;
+	UINTN i = FindExtent(File, Run->Offset), NewMax;
+
+	Prev = (i > 0) ? &File->Extents[i - 1] : NULL;
+	Next = (i < File->NumExtents) ? &File->Extents[i] : NULL;
+
+	/* Never replace what we already know */
+	if ((Next != NULL) && (Next->Offset < Run->Offset + Run->Length))
+		return;
+
+	/* Coalesce with the neighbours where possible */
+	if ((Prev != NULL) && (Prev->Offset + Prev->Length == Run->Offset) &&
+		(Prev->Address + Prev->Length == Run->Address)) {
+		Prev->Length += Run->Length;
+		if ((Next != NULL) && (Prev->Offset + Prev->Length == Next->Offset) &&
+			(Prev->Address + Prev->Length == Next->Address)) {
+			Prev->Length += Next->Length;
+			CopyMem(Next, &Next[1], (File->NumExtents - i - 1) * sizeof(EFI_GRUB_EXTENT));
+			File->NumExtents--;
+		}
+		return;
+	}
+	if ((Next != NULL) && (Run->Offset + Run->Length == Next->Offset) &&
+		(Run->Address + Run->Length == Next->Address)) {
+		Next->Offset = Run->Offset;
+		Next->Address = Run->Address;
+		Next->Length += Run->Length;
+		return;
+	}
+
+	if (File->NumExtents >= File->MaxExtents) {
+		if (File->MaxExtents >= MAX_FILE_EXTENTS)
+			return;
+		NewMax = (File->MaxExtents == 0) ? 16 : 2 * File->MaxExtents;
+		NewExtents = ReallocatePool(File->MaxExtents * sizeof(EFI_GRUB_EXTENT),
+			NewMax * sizeof(EFI_GRUB_EXTENT), File->Extents);
+		if (NewExtents == NULL)
+			return;
+		File->Extents = NewExtents;
+		File->MaxExtents = NewMax;
+	}
+
+	/* CopyMem() handles overlapping buffers */
+	CopyMem(&File->Extents[i + 1], &File->Extents[i],
+		(File->NumExtents - i) * sizeof(EFI_GRUB_EXTENT));
+	CopyMem(&File->Extents[i], Run, sizeof(EFI_GRUB_EXTENT));
+	File->NumExtents++;
+}
+
+static grub_err_t
+ExtentHook(grub_disk_addr_t sector, unsigned offset, unsigned length,
+		char *buf, void *data)
+{
+	EXTENT_HOOK_DATA *HookData = (EXTENT_HOOK_DATA *) data;
+	EFI_GRUB_EXTENT *Run, *NewRuns;
+	UINT64 Offset, Address;
+	UINTN NewMax;
+
+	/* Only consider data that was read straight into our buffer */
+	if (HookData->Failed || (length == 0) ||
+		((CHAR8 *) buf < HookData->Buf) ||
+		((CHAR8 *) buf + length > HookData->Buf + HookData->Len))
+		return GRUB_ERR_NONE;
+
+	Offset = HookData->Offset + (UINT64)((CHAR8 *) buf - HookData->Buf);
+	Address = sector * GRUB_DISK_SECTOR_SIZE + offset;
+
+	if (HookData->NumRuns != 0) {
+		Run = &HookData->Runs[HookData->NumRuns - 1];
+		if ((Run->Offset + Run->Length == Offset) && (Run->Address + Run->Length == Address)) {
+			Run->Length += length;
+			return GRUB_ERR_NONE;
+		}
+	}
+
+	if (HookData->NumRuns >= HookData->MaxRuns) {
+		NewMax = (HookData->MaxRuns == 0) ? 16 : 2 * HookData->MaxRuns;
+		NewRuns = ReallocatePool(HookData->MaxRuns * sizeof(EFI_GRUB_EXTENT),
+			NewMax * sizeof(EFI_GRUB_EXTENT), HookData->Runs);
+		if (NewRuns == NULL) {
+			HookData->Failed = TRUE;
+			return GRUB_ERR_NONE;
+		}
+		HookData->Runs = NewRuns;
+		HookData->MaxRuns = NewMax;
+	}
+
+	Run = &HookData->Runs[HookData->NumRuns++];
+	Run->Offset = Offset;
+	Run->Length = length;
+	Run->Address = Address;
+	return GRUB_ERR_NONE;
+}
+
+/* Read data from GRUB at the current offset, while recording its extents */
+static grub_ssize_t
+GrubReadAndMap(EFI_GRUB_FILE *File, CHAR8 *Buf, UINTN Size)
+{
+	grub_fs_t p = grub_fs_list;
+	grub_file_t f = (grub_file_t) File->GrubFile;
+	EXTENT_HOOK_DATA HookData;
+	grub_ssize_t len;
+	UINTN i;
+
+	ZeroMem(&HookData, sizeof(HookData));
+	HookData.File = File;
+	HookData.Buf = Buf;
+	HookData.Offset = f->offset;
+	HookData.Len = Size;
+	f->read_hook = ExtentHook;
+	f->read_hook_data = &HookData;
+
+	grub_errno = 0;
+	len = p->fs_read(f, Buf, (grub_size_t) Size);
+
+	/* Some drivers copy the hook to the disk, which must not keep our stack data */
+	f->read_hook = NULL;
+	f->read_hook_data = NULL;
+	if (f->device->disk != NULL) {
+		f->device->disk->read_hook = NULL;
+		f->device->disk->read_hook_data = NULL;
+	}
+	if ((len > 0) && !HookData.Failed) {
+		for (i = 0; i < HookData.NumRuns; i++)
+			if (HookData.Runs[i].Offset + HookData.Runs[i].Length <= f->offset + len)
+				AddExtent(File, &HookData.Runs[i]);
+	}
+	if (HookData.Runs != NULL)
+		FreePool(HookData.Runs);
+
+	return len;
+}
+
+/*
+ * Small reads, of data we can't get from the disk directly, go through a
+ * read window. This way, data that GRUB needs to decode in blocks, such as
+ * an NTFS compression unit, only gets decoded once, even if the caller
+ * reads it piecemeal or seeks back into it.
+ * When the caller keeps reading past the end of the window, we double the
+ * size of the next one, so that sequential reads end up being mapped, and
+ * read, in large chunks rather than one extent lookup at a time.
+ */
+static grub_ssize_t
+GrubFillWindow(EFI_GRUB_FILE *File)
+{
+	EFI_FS *FileSystem = File->FileSystem;
+	grub_file_t f = (grub_file_t) File->GrubFile;
+	grub_off_t Offset = f->offset, WindowOffset;
+	grub_ssize_t len;
+	EFI_READ_WINDOW *Window;
+	UINTN Size, PathLen;
+
+	/* See if we decoded that data before */
+	Window = AcquireWindow(FileSystem, File->path, Offset);
+	if (Window != NULL) {
+		if (File->Window != NULL)
+			ReleaseWindow(FileSystem, File->Window);
+		File->Window = Window;
+		/* Carry on from there at (at least) the size of that window */
+		File->ReadAhead = MAX(File->ReadAhead, MAX(READ_WINDOW_SIZE, Window->Size));
+		return (grub_ssize_t) Window->Size;
+	}
+
+	if ((File->Window != NULL) && (Offset == File->Window->Offset + File->Window->Size)) {
+		File->ReadAhead = MIN(2 * File->ReadAhead, MAX_READ_AHEAD_SIZE);
+		WindowOffset = Offset;
+	} else {
+		File->ReadAhead = READ_WINDOW_SIZE;
+		WindowOffset = Offset & ~((UINT64) READ_WINDOW_SIZE - 1);
+	}
+
+	/* Keep the previous window around, in case the caller goes back to it */
+	if (File->Window != NULL)
+		ReleaseWindow(FileSystem, File->Window);
+	File->Window = NULL;
+
+	/*
+	 * Windows are only as large as the data they hold, so that the pool
+	 * can keep the content of many small files (which, on file systems
+	 * such as SquashFS, are costly to decode) rather than a few of them.
+	 */
+	PathLen = strlena(File->path);
+	Window = AllocateZeroPool(sizeof(EFI_READ_WINDOW) + PathLen);
+	if (Window == NULL)
+		return -1;
+	CopyMem(Window->Path, File->path, PathLen + 1);
+	Window->Hash = PathHash(Window->Path);
+	Size = (UINTN) MIN((UINT64) File->ReadAhead, f->size - WindowOffset);
+	Window->Data = AllocatePool(Size);
+	if ((Window->Data == NULL) && (Size > READ_WINDOW_SIZE)) {
+		File->ReadAhead = READ_WINDOW_SIZE;
+		Size = (UINTN) MIN((UINT64) File->ReadAhead, f->size - WindowOffset);
+		Window->Data = AllocatePool(Size);
+	}
+	if (Window->Data == NULL) {
+		FreeWindow(Window);
+		return -1;
+	}
+	Window->AllocSize = sizeof(EFI_READ_WINDOW) + PathLen + Size;
+	Window->Offset = WindowOffset;
+	File->Window = Window;
+
+	f->offset = WindowOffset;
+	len = GrubReadAndMap(File, Window->Data, Size);
+	f->offset = Offset;
+	if (len > 0)
+		Window->Size = (UINTN) len;
+
+	return len;
 }
 
 EFI_STATUS
 GrubRead(EFI_GRUB_FILE *File, VOID *Data, UINTN *Len)
 {
-	grub_fs_t p = grub_fs_list;
+	EFI_STATUS Status;
 	grub_file_t f = (grub_file_t) File->GrubFile;
+	grub_off_t StartOffset = f->offset;
 	grub_ssize_t len;
-	UINTN Remaining;
+	UINT64 Address;
+	EFI_GRUB_EXTENT *Extent;
+	EFI_READ_WINDOW *Window;
+	CHAR8 *Buf = (CHAR8 *) Data;
+	UINTN i, Remaining, Size, Done = 0;
 
 	/* GRUB may return an error if we request more data than available */
 	Remaining = (UINTN)((f->size > f->offset)? f->size - f->offset : 0);
@@ -392,19 +1239,69 @@ GrubRead(EFI_GRUB_FILE *File, VOID *Data, UINTN *Len)
 	if (*Len > Remaining)
 		*Len = Remaining;
 
-	grub_errno = 0;
-	len = p->fs_read(f, (char *) Data, (grub_size_t) *Len);
-
-	if (len < 0) {
-		*Len = 0;
-		return GrubErrToEFIStatus(grub_errno);
+	/* What this handle knows about the file's data may be for another media */
+	GrubCheckMedia(File->FileSystem);
+	if (File->MediaId != File->FileSystem->MediaId) {
+		if (File->Extents != NULL)
+			FreePool(File->Extents);
+		File->Extents = NULL;
+		File->NumExtents = 0;
+		File->MaxExtents = 0;
+		if (File->Window != NULL)
+			FreeWindow(File->Window);
+		File->Window = NULL;
+		File->MediaId = File->FileSystem->MediaId;
 	}
 
-	/* You'd think that GRUB read() would increase the offset... */
-	f->offset += len;
-	*Len = (UINTN)len;
+	while (Done < *Len) {
+		Size = *Len - Done;
+		i = FindExtent(File, f->offset);
+		Extent = (i < File->NumExtents) ? &File->Extents[i] : NULL;
+		Window = File->Window;
+
+		if ((Window != NULL) && (f->offset >= Window->Offset) &&
+			(f->offset < Window->Offset + Window->Size)) {
+			/* Serve the data from our read window */
+			Size = (UINTN) MIN((UINT64) Size, Window->Offset + Window->Size - f->offset);
+			CopyMem(&Buf[Done], &Window->Data[f->offset - Window->Offset], Size);
+			len = (grub_ssize_t) Size;
+		} else if ((Extent != NULL) && (Extent->Offset <= f->offset)) {
+			/* We know where this data is, so read it from the disk directly */
+			Size = (UINTN) MIN((UINT64) Size, Extent->Offset + Extent->Length - f->offset);
+			Address = Extent->Address + (f->offset - Extent->Offset);
+			Status = DiskRead(File->FileSystem, Address, Size, &Buf[Done]);
+			if (EFI_ERROR(Status)) {
+				grub_error(GRUB_ERR_READ_ERROR, N_("Could not read block"));
+				goto error;
+			}
+			len = (grub_ssize_t) Size;
+		} else {
+			/* Don't let GRUB read into data we already know about */
+			if ((Extent != NULL) && (Extent->Offset - f->offset < (UINT64) Size))
+				Size = (UINTN)(Extent->Offset - f->offset);
+			if ((Size < READ_WINDOW_SIZE) && (GrubFillWindow(File) > 0) &&
+				(f->offset >= File->Window->Offset) &&
+				(f->offset < File->Window->Offset + File->Window->Size))
+				continue;
+			len = GrubReadAndMap(File, &Buf[Done], Size);
+			if (len < 0)
+				goto error;
+			if (len == 0)
+				break;
+		}
+
+		/* You'd think that GRUB read() would increase the offset... */
+		f->offset += len;
+		Done += (UINTN) len;
+	}
 
+	*Len = Done;
 	return EFI_SUCCESS;
+
+error:
+	f->offset = StartOffset;
+	*Len = 0;
+	return GrubErrToEFIStatus(grub_errno);
 }
 
 EFI_STATUS
@@ -85,3 +85,15 @@ VOID CopyPathRelative(CHAR8 *dest, CHAR8 *src, INTN len)
 	}
 	o[len?0:-1] = '\0';
 }
+
+/* FNV-1a hash of a path, for the path cache and the read window pool */
+UINT32 PathHash(const CHAR8 *Path)
+{
+	UINT32 Hash = 2166136261U;
+
+	while (*Path != 0) {
+		Hash ^= (UINT8) *Path++;
+		Hash *= 16777619U;
+	}
+	return Hash;
+}